@@ -2,6 +2,53 @@
 #define LINQ_H_
 
 #include <vector>
+#include <array>
+#include <optional>
+#include <variant>
+#include <cassert>
+#include <cstdlib>
+#include <string>
+#include <memory>
+#include <new>
+#include <cstddef>
+#include <cstdint>
+#include <cmath>
+#include <limits>
+#include <deque>
+#include <unordered_set>
+#include <algorithm>
+#include <functional>
+#include <initializer_list>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <iterator>
+#include <tuple>
+#include <utility>
+#include <type_traits>
+#include <string_view>
+#include <charconv>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+// C++20 allows virtual calls and std::vector in constant expressions, so pipelines over constant data
+// can be evaluated at compile time.
+#if defined(__cpp_constexpr) && __cpp_constexpr >= 201907L
+#define LINQ_HAS_CONSTEXPR 1
+#define LINQ_CONSTEXPR constexpr
+#else
+#define LINQ_HAS_CONSTEXPR 0
+#define LINQ_CONSTEXPR
+#endif
+
+#if LINQ_HAS_CONSTEXPR && defined(__cpp_lib_constexpr_vector) && __cpp_lib_constexpr_vector >= 201907L
+#define LINQ_CONSTEXPR_VECTOR constexpr
+#else
+#define LINQ_CONSTEXPR_VECTOR
+#endif
 
 template<typename T, typename Iter>
 class range_enumerator;
@@ -9,60 +56,443 @@ template<typename T>
 class drop_enumerator;
 template<typename T>
 class take_enumerator;
-template<typename T, typename U, typename F>
+template<typename T, typename U, typename F, bool ByReference = false>
 class select_enumerator;
 template<typename T, typename F>
 class until_enumerator;
 template<typename T, typename F>
 class where_enumerator;
+template<typename T>
+class cache_enumerator;
+template<typename T>
+class short_circuit_enumerator;
+template<typename T>
+class prefetch_enumerator;
+template<typename T>
+class hyperloglog;
+template<typename T>
+class quantile_sketch;
+template<typename T>
+class reservoir_sample;
+template<typename T>
+class lookup_set;
+template<typename T>
+class compressed_ints;
+
+template<typename E>
+class unexpected {
+public:
+    LINQ_CONSTEXPR explicit unexpected(E error) : error_(std::move(error)) {
+    }
+
+    LINQ_CONSTEXPR const E& error() const {
+        return error_;
+    }
+
+private:
+    E error_;
+};
+
+template<typename E>
+LINQ_CONSTEXPR auto make_unexpected(E error) {
+    return unexpected<E>(std::move(error));
+}
+
+/// Value or error, used to pass failures along a pipeline without exceptions.
+template<typename T, typename E>
+class expected {
+public:
+    using value_type = T;
+    using error_type = E;
+
+    LINQ_CONSTEXPR expected(T value) : storage_(std::in_place_index<0>, std::move(value)) {
+    }
+
+    LINQ_CONSTEXPR expected(unexpected<E> error) : storage_(std::in_place_index<1>, std::move(error)) {
+    }
+
+    LINQ_CONSTEXPR bool has_value() const {
+        return storage_.index() == 0;
+    }
+
+    LINQ_CONSTEXPR explicit operator bool() const {
+        return has_value();
+    }
+
+    LINQ_CONSTEXPR const T& value() const {
+        assert(has_value());
+        return *std::get_if<0>(&storage_);
+    }
+
+    LINQ_CONSTEXPR T& value() {
+        assert(has_value());
+        return *std::get_if<0>(&storage_);
+    }
+
+    LINQ_CONSTEXPR const E& error() const {
+        assert(!has_value());
+        return std::get_if<1>(&storage_)->error();
+    }
+
+    LINQ_CONSTEXPR const T& operator*() const {
+        return value();
+    }
+
+    LINQ_CONSTEXPR T& operator*() {
+        return value();
+    }
+
+    LINQ_CONSTEXPR bool operator==(const expected &other) const {
+        if (has_value() != other.has_value())
+            return false;
+        return has_value() ? value() == other.value() : error() == other.error();
+    }
+
+private:
+    std::variant<T, unexpected<E>> storage_;
+};
+
+template<typename T>
+struct is_expected : std::false_type {
+};
+
+template<typename T, typename E>
+struct is_expected<expected<T, E>> : std::true_type {
+};
+
+// splitmix64 finalizer: std::hash of integers is often the identity, sketches need well mixed bits.
+inline std::uint64_t mix_hash(std::uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+class sketch_random {
+public:
+    explicit sketch_random(std::uint64_t seed) : state_(seed) {
+    }
+
+    std::uint64_t next() {
+        state_ += 0x9e3779b97f4a7c15ULL;
+        return mix_hash(state_);
+    }
+
+    std::uint64_t below(std::uint64_t bound) {
+        return next() % bound;
+    }
+
+private:
+    std::uint64_t state_;
+};
+
+/// Not constexpr on purpose: reaching it during constant evaluation is a compile error.
+[[noreturn]] inline void to_array_size_mismatch() {
+    assert(!"to_array<N>() needs exactly N elements");
+    std::abort();
+}
+
+template<typename Iter, typename V = typename std::iterator_traits<Iter>::value_type>
+struct is_contiguous_iterator : std::integral_constant<bool,
+        std::is_same<Iter, typename std::vector<V>::iterator>::value ||
+        std::is_same<Iter, typename std::vector<V>::const_iterator>::value ||
+        std::is_same<Iter, std::string::iterator>::value ||
+        std::is_same<Iter, std::string::const_iterator>::value> {
+};
+
+template<typename Iter>
+struct is_contiguous_iterator<Iter, void> : std::false_type {
+};
+
+template<typename Iter>
+struct is_contiguous_iterator<Iter, bool> : std::false_type {
+};
+
+template<typename T, typename V>
+struct is_contiguous_iterator<T*, V> : std::true_type {
+};
+
+template<>
+struct is_contiguous_iterator<bool*, bool> : std::true_type {
+};
+
+template<>
+struct is_contiguous_iterator<const bool*, bool> : std::true_type {
+};
+
+class buffered_fd_writer {
+public:
+    explicit buffered_fd_writer(int fd) : fd_(fd), buffer_(new char[buffer_size]), size_(0), ok_(true) {
+    }
+
+    ~buffered_fd_writer() {
+        flush();
+    }
+
+    buffered_fd_writer(const buffered_fd_writer &) = delete;
+    buffered_fd_writer& operator=(const buffered_fd_writer &) = delete;
+
+    void write(const void *data, std::size_t size) {
+        if (size == 0) /// An empty range may come with a null pointer, which memcpy does not accept
+            return;
+        if (size_ + size > buffer_size) {
+            flush();
+            if (size >= buffer_size) {
+                write_all(static_cast<const char*>(data), size);
+                return;
+            }
+        }
+        std::memcpy(buffer_.get() + size_, data, size);
+        size_ += size;
+    }
+
+    template<typename T>
+    void write_formatted(const T &value) {
+        if constexpr (std::is_convertible<const T&, std::string_view>::value) {
+            std::string_view view(value);
+            write(view.data(), view.size());
+        } else {
+            static_assert(std::is_arithmetic<T>::value, "only arithmetic and string-like values can be formatted");
+            if (size_ + max_formatted_size > buffer_size)
+                flush();
+            char *begin = buffer_.get() + size_;
+            std::to_chars_result res;
+            if constexpr (std::is_same<T, bool>::value)
+                res = std::to_chars(begin, begin + max_formatted_size, int(value));
+            else
+                res = std::to_chars(begin, begin + max_formatted_size, value);
+            size_ = res.ptr - buffer_.get();
+        }
+    }
+
+    bool flush() {
+        write_all(buffer_.get(), size_);
+        size_ = 0;
+        return ok_;
+    }
+
+    bool ok() const {
+        return ok_;
+    }
+
+private:
+    static const std::size_t buffer_size = 1 << 16;
+    static const std::size_t max_formatted_size = 64;
+
+    void write_all(const char *data, std::size_t size) {
+        while (ok_ && size > 0) {
+            ssize_t written = ::write(fd_, data, size);
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                ok_ = false;
+                return;
+            }
+            data += written;
+            size -= written;
+        }
+    }
+
+    int fd_;
+    std::unique_ptr<char[]> buffer_;
+    std::size_t size_;
+    bool ok_;
+};
 
 template<typename T>
 class enumerator {
 public:
-    virtual const T& operator*() = 0; // Получает текущий элемент.
-    virtual enumerator<T>& operator++() = 0;  // Переход к следующему элементу
-    virtual explicit operator bool() = 0;  // Возвращает true, если есть текущий элемент
+    using value_type = T;
+
+    LINQ_CONSTEXPR virtual const T& operator*() = 0; // Получает текущий элемент.
+    LINQ_CONSTEXPR virtual enumerator<T>& operator++() = 0;  // Переход к следующему элементу
+    LINQ_CONSTEXPR virtual explicit operator bool() = 0;  // Возвращает true, если есть текущий элемент
+
+    /// Hint from downstream: at most count more elements, the current one included, will be read.
+    LINQ_CONSTEXPR virtual void limit_demand(std::size_t /*count*/) {
+    }
+
+    /// Called after the source has grown: stages that reached the end pick up the new elements.
+    virtual void refresh() {
+    }
 
-    auto drop(int count) {
+    /// If all remaining elements lie contiguously in memory, returns them and moves to the end.
+    virtual bool release_contiguous(const T *&/*data*/, std::size_t &/*size*/) {
+        return false;
+    }
+
+    LINQ_CONSTEXPR auto drop(int count) {
         return drop_enumerator<T>(*this, count);
     }
 
-    auto take(int count) {
+    LINQ_CONSTEXPR auto take(int count) {
         return take_enumerator<T>(*this, count);
     }
 
-    template<typename U = T, typename F>
-    auto select(F func) {
-        return select_enumerator<U, T, F>(*this, func);
+    /// The result type is deduced from func unless given explicitly; if func returns an lvalue
+    /// reference, the referenced object is passed through without a copy.
+    template<typename U = void, typename F>
+    LINQ_CONSTEXPR auto select(F func) {
+        using result = std::invoke_result_t<F&, const T&>;
+        if constexpr (std::is_void<U>::value && std::is_lvalue_reference<result>::value)
+            return select_enumerator<std::remove_cv_t<std::remove_reference_t<result>>, T, F, true>(*this, func);
+        else if constexpr (std::is_void<U>::value)
+            return select_enumerator<std::decay_t<result>, T, F>(*this, func);
+        else
+            return select_enumerator<U, T, F>(*this, func);
     }
 
     template<typename F>
-    auto until(F func) {
+    LINQ_CONSTEXPR auto until(F func) {
         return until_enumerator<T, F>(*this, func);
     }
 
-    auto until_eq(const T &value) {
+    LINQ_CONSTEXPR auto until_eq(const T &value) {
         return until([value](T x) { return x == value; });
     }
 
-    auto until_neq(const T &value) {
+    LINQ_CONSTEXPR auto until_neq(const T &value) {
         return until([value](T x) { return x != value; });
     }
 
     template<typename F>
-    auto where(F func) {
+    LINQ_CONSTEXPR auto where(F func) {
         return where_enumerator<T, F>(*this, func);
     }
 
-    auto where_eq(const T &value) {
+    LINQ_CONSTEXPR auto where_eq(const T &value) {
         return where([value](T x) { return x == value; });
     }
 
-    auto where_neq(const T &value) {
+    LINQ_CONSTEXPR auto where_neq(const T &value) {
         return where([value](T x) { return x != value; });
     }
 
-    std::vector<T> to_vector() {
+    /// Keeps elements with lo <= x <= hi.
+    LINQ_CONSTEXPR auto where_between(const T &lo, const T &hi) {
+        return where([lo, hi](const T &x) { return !(x < lo) && !(hi < x); });
+    }
+
+    /// The set is only read, so one lookup_set can serve many pipelines and threads; it must outlive the stage.
+    auto where_in(const lookup_set<T> &set) {
+        return where([&set](const T &x) { return set.contains(x); });
+    }
+
+    auto where_not_in(const lookup_set<T> &set) {
+        return where([&set](const T &x) { return !set.contains(x); });
+    }
+
+    auto where_in(std::initializer_list<T> values) {
+        auto set = std::make_shared<const lookup_set<T>>(values);
+        return where([set](const T &x) { return set->contains(x); });
+    }
+
+    auto where_not_in(std::initializer_list<T> values) {
+        auto set = std::make_shared<const lookup_set<T>>(values);
+        return where([set](const T &x) { return !set->contains(x); });
+    }
+
+    template<typename Container>
+    auto where_in(const Container &values) {
+        auto set = std::make_shared<const lookup_set<T>>(values);
+        return where([set](const T &x) { return set->contains(x); });
+    }
+
+    template<typename Container>
+    auto where_not_in(const Container &values) {
+        auto set = std::make_shared<const lookup_set<T>>(values);
+        return where([set](const T &x) { return !set->contains(x); });
+    }
+
+    /// func returns expected<U, E>; errors are passed downstream as values.
+    template<typename F>
+    LINQ_CONSTEXPR auto select_expected(F func) {
+        static_assert(is_expected<std::decay_t<std::invoke_result_t<F&, const T&>>>::value,
+                      "select_expected requires a function returning expected<U, E>");
+        return select(func);
+    }
+
+    /// Skips errors of an enumerator over expected<U, E>.
+    LINQ_CONSTEXPR auto where_ok() {
+        static_assert(is_expected<T>::value, "where_ok requires an enumerator over expected<U, E>");
+        return where([](const T &x) { return x.has_value(); });
+    }
+
+    /// Stops right after the first error of an enumerator over expected<U, E>.
+    LINQ_CONSTEXPR auto short_circuit_on_error() {
+        static_assert(is_expected<T>::value, "short_circuit_on_error requires an enumerator over expected<U, E>");
+        return short_circuit_enumerator<T>(*this);
+    }
+
+    /// Collects values of an enumerator over expected<U, E>, or returns the first error without reading further.
+    template<typename X = T>
+    LINQ_CONSTEXPR_VECTOR expected<std::vector<typename X::value_type>, typename X::error_type> to_expected_vector() {
+        static_assert(is_expected<X>::value, "to_expected_vector requires an enumerator over expected<U, E>");
+        std::vector<typename X::value_type> ans;
+        while ((bool)*this) {
+            const T &x = *(*this);
+            if (!x.has_value())
+                return make_unexpected(x.error());
+            ans.push_back(x.value());
+            ++(*this);
+        }
+
+        return ans;
+    }
+
+    /// Reads up to count elements ahead on a background thread; count == 0 reads synchronously.
+    auto prefetch(std::size_t count) {
+        return prefetch_enumerator<T>(*this, count);
+    }
+
+    /// HyperLogLog sketch with 2^precision registers, relative error about 1.04 / sqrt(2^precision).
+    hyperloglog<T> approx_count_distinct(int precision = 12) {
+        hyperloglog<T> sketch(precision);
+        while ((bool)*this) {
+            sketch.add(*(*this));
+            ++(*this);
+        }
+
+        return sketch;
+    }
+
+    /// KLL quantile sketch with rank error about eps.
+    quantile_sketch<T> approx_quantiles(double eps = 0.01) {
+        quantile_sketch<T> sketch(eps);
+        while ((bool)*this) {
+            sketch.add(*(*this));
+            ++(*this);
+        }
+
+        return sketch;
+    }
+
+    /// Uniform sample of count elements (reservoir sampling).
+    reservoir_sample<T> sample(std::size_t count, std::uint64_t seed = 0) {
+        reservoir_sample<T> sketch(count, seed);
+        while ((bool)*this) {
+            sketch.add(*(*this));
+            ++(*this);
+        }
+
+        return sketch;
+    }
+
+    compressed_ints<T> to_compressed() {
+        compressed_ints<T> ans;
+        while ((bool)*this) {
+            ans.push_back(*(*this));
+            ++(*this);
+        }
+
+        return ans;
+    }
+
+    auto cache() {
+        return cache_enumerator<T>(*this);
+    }
+
+    LINQ_CONSTEXPR_VECTOR std::vector<T> to_vector() {
         std::vector<T> ans;
         while ((bool)*this) {
             ans.push_back(std::move(*(*this)));
@@ -72,33 +502,111 @@ public:
         return std::move(ans);
     }
 
+    template<std::size_t N>
+    LINQ_CONSTEXPR std::array<T, N> to_array() {
+        std::array<T, N> ans{};
+        for (std::size_t i = 0; i < N; i++) {
+            if (!(bool)*this)
+                to_array_size_mismatch();
+            ans[i] = std::move(*(*this));
+            ++(*this);
+        }
+        if ((bool)*this)
+            to_array_size_mismatch();
+
+        return ans;
+    }
+
     template<typename Iter>
     void copy_to(Iter it) {
+        if constexpr (std::is_trivially_copyable<T>::value && is_contiguous_iterator<Iter>::value &&
+                      std::is_same<typename std::iterator_traits<Iter>::value_type, T>::value) {
+            const T *data;
+            std::size_t size;
+            if (release_contiguous(data, size)) {
+                if (size > 0) /// memmove, since the source may overlap the destination
+                    std::memmove(&*it, data, size * sizeof(T));
+                return;
+            }
+        }
         while ((bool)*this) {
             *it = std::move(*(*this));
             it++;
             ++(*this);
         }
     }
+
+    bool to_fd(int fd, std::string_view delimiter = "\n") {
+        buffered_fd_writer out(fd);
+        while ((bool)*this) {
+            out.write_formatted(*(*this));
+            out.write(delimiter.data(), delimiter.size());
+            ++(*this);
+        }
+        return out.flush();
+    }
+
+    bool to_file(const char *path, std::string_view delimiter = "\n") {
+        int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return false;
+        bool ok = to_fd(fd, delimiter);
+        return ::close(fd) == 0 && ok;
+    }
+
+    bool to_fd_raw(int fd) {
+        static_assert(std::is_trivially_copyable<T>::value, "raw records require a trivially copyable type");
+        buffered_fd_writer out(fd);
+        const T *data;
+        std::size_t size;
+        if (release_contiguous(data, size)) {
+            out.write(data, size * sizeof(T));
+            return out.flush();
+        }
+        while ((bool)*this) {
+            out.write(&*(*this), sizeof(T));
+            ++(*this);
+        }
+        return out.flush();
+    }
+
+    bool to_file_raw(const char *path) {
+        int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return false;
+        bool ok = to_fd_raw(fd);
+        return ::close(fd) == 0 && ok;
+    }
 };
 
 template<typename T, typename Iter>
 class range_enumerator : public enumerator<T> {
 public:
-    explicit operator bool() override {
+    LINQ_CONSTEXPR explicit operator bool() override {
         return begin_ != end_;
     }
 
-    enumerator<T>& operator++() override {
+    LINQ_CONSTEXPR enumerator<T>& operator++() override {
         begin_++;
         return *this;
     }
 
-    const T& operator*() override {
+    LINQ_CONSTEXPR const T& operator*() override {
         return *begin_; /// Safe or not safe, raise exception?
     }
 
-    range_enumerator(Iter begin, Iter end) : begin_(begin), end_(end) {
+    bool release_contiguous(const T *&data, std::size_t &size) override {
+        if constexpr (is_contiguous_iterator<Iter>::value) {
+            size = end_ - begin_;
+            data = size > 0 ? &*begin_ : nullptr;
+            begin_ = end_;
+            return true;
+        } else {
+            return false;
+        }
+    }
+
+    LINQ_CONSTEXPR range_enumerator(Iter begin, Iter end) : begin_(begin), end_(end) {
     }
 
 private:
@@ -106,34 +614,51 @@ private:
 };
 
 template<typename T>
-auto from(T begin, T end) {
+LINQ_CONSTEXPR auto from(T begin, T end) {
     return range_enumerator<typename std::iterator_traits<T>::value_type, T>(begin, end);
 }
 
 template<typename T>
 class drop_enumerator : public enumerator<T> {
 public:
-    drop_enumerator(enumerator<T> &parent, int count) : parent_(parent), count_(count) {
-        while (count_ > 0 && bool(*this)) {
-            ++parent_;
-            count_--;
-        }
+    LINQ_CONSTEXPR drop_enumerator(enumerator<T> &parent, int count) : parent_(parent), count_(count) {
+        skip();
     }
 
-    explicit operator bool() override {
+    LINQ_CONSTEXPR explicit operator bool() override {
         return bool(parent_);
     }
 
-    enumerator<T>& operator++() override {
+    LINQ_CONSTEXPR enumerator<T>& operator++() override {
         ++parent_;
         return *this;
     }
 
-    const T& operator*() override {
+    LINQ_CONSTEXPR const T& operator*() override {
         return *parent_;
     }
 
+    LINQ_CONSTEXPR void limit_demand(std::size_t count) override {
+        parent_.limit_demand(count);
+    }
+
+    bool release_contiguous(const T *&data, std::size_t &size) override {
+        return parent_.release_contiguous(data, size);
+    }
+
+    void refresh() override {
+        parent_.refresh();
+        skip();
+    }
+
 private:
+    LINQ_CONSTEXPR void skip() {
+        while (count_ > 0 && bool(parent_)) {
+            ++parent_;
+            count_--;
+        }
+    }
+
     enumerator<T> &parent_;
     int count_;
 };
@@ -141,16 +666,17 @@ private:
 template<typename T>
 class take_enumerator : public enumerator<T> {
 public:
-    take_enumerator(enumerator<T> &parent, int count) : parent_(parent), count_(count), is_end_(false) {
+    LINQ_CONSTEXPR take_enumerator(enumerator<T> &parent, int count) : parent_(parent), count_(count), is_end_(false) {
         if (!count_)
             is_end_ = true;
+        parent_.limit_demand(count_);
     }
 
-    explicit operator bool() override {
+    LINQ_CONSTEXPR explicit operator bool() override {
         return !is_end_ && bool(parent_);
     }
 
-    enumerator<T>& operator++() override {
+    LINQ_CONSTEXPR enumerator<T>& operator++() override {
         ++parent_;
         count_--;
         if (count_ == 0)
@@ -158,70 +684,98 @@ public:
         return *this;
     }
 
-    const T& operator*() override {
+    LINQ_CONSTEXPR const T& operator*() override {
         return *parent_;
     }
 
+    LINQ_CONSTEXPR void limit_demand(std::size_t count) override {
+        parent_.limit_demand(std::min(count, std::size_t(count_)));
+    }
+
+    void refresh() override {
+        parent_.refresh();
+    }
+
 private:
     enumerator<T> &parent_;
     int count_;
     bool is_end_;
 };
 
-template<typename T, typename U, typename F>
+template<typename T, typename U, typename F, bool ByReference>
 class select_enumerator : public enumerator<T> {
 public:
-    select_enumerator(enumerator<U> &parent, F &func) : parent_(parent), func_(std::move(func)), is_calculated_(false) {
+    LINQ_CONSTEXPR select_enumerator(enumerator<U> &parent, F &func) : parent_(parent), func_(std::move(func)), calculated_value_() {
     }
 
-    explicit operator bool() override {
+    LINQ_CONSTEXPR explicit operator bool() override {
         return bool(parent_);
     }
 
-    enumerator<T>& operator++() override {
+    LINQ_CONSTEXPR enumerator<T>& operator++() override {
         ++parent_;
-        is_calculated_ = false;
+        calculated_value_ = {};
         return *this;
     }
 
-    const T& operator*() override {
-        if (!is_calculated_) {
-            calculated_value_ = std::move(func_(*parent_));
-            is_calculated_ = true;
+    LINQ_CONSTEXPR const T& operator*() override {
+        if (!calculated_value_) {
+            if constexpr (ByReference)
+                calculated_value_ = &func_(*parent_);
+            else
+                calculated_value_.emplace(func_(*parent_));
         }
-        return calculated_value_;
+        return *calculated_value_;
+    }
+
+    LINQ_CONSTEXPR void limit_demand(std::size_t count) override {
+        parent_.limit_demand(count);
+    }
+
+    void refresh() override {
+        parent_.refresh();
+        calculated_value_ = {};
     }
 
 private:
     enumerator<U> &parent_;
     F func_;
-    bool is_calculated_;
-    T calculated_value_;
+    std::conditional_t<ByReference, const T*, std::optional<T>> calculated_value_;
 };
 
 template<typename T, typename F>
 class until_enumerator : public enumerator<T> {
 public:
-    until_enumerator(enumerator<T> &parent, F &predicate) : parent_(parent), predicate_(std::move(predicate)), is_end_(false) {
-        if (!parent_ || predicate_(*parent))
+    LINQ_CONSTEXPR until_enumerator(enumerator<T> &parent, F &predicate) : parent_(parent), predicate_(std::move(predicate)), is_end_(false) {
+        if (parent_ && predicate_(*parent_))
             is_end_ = true;
     }
 
-    explicit operator bool() override {
+    LINQ_CONSTEXPR explicit operator bool() override {
         return !is_end_ && bool(parent_);
     }
 
-    enumerator<T>& operator++() override {
+    LINQ_CONSTEXPR enumerator<T>& operator++() override {
         ++parent_;
         if (parent_ && predicate_(*parent_)) /// No need for parent
             is_end_ = true;
         return *this;
     }
 
-    const T& operator*() override {
+    LINQ_CONSTEXPR const T& operator*() override {
         return *parent_;
     }
 
+    LINQ_CONSTEXPR void limit_demand(std::size_t count) override {
+        parent_.limit_demand(count);
+    }
+
+    void refresh() override {
+        parent_.refresh();
+        if (!is_end_ && parent_ && predicate_(*parent_))
+            is_end_ = true;
+    }
+
 private:
     enumerator<T> &parent_;
     F predicate_;
@@ -231,28 +785,1296 @@ private:
 template<typename T, typename F>
 class where_enumerator : public enumerator<T> {
 public:
-    where_enumerator(enumerator<T> &parent, F &predicate) : parent_(parent), predicate_(std::move(predicate)) {
-        while (parent_ && !predicate_(*parent_))
-            ++parent_;
+    LINQ_CONSTEXPR where_enumerator(enumerator<T> &parent, F &predicate)
+            : parent_(parent), predicate_(std::move(predicate)), demand_(SIZE_MAX), is_settled_(false) {
+        settle();
     }
 
-    explicit operator bool() override {
+    LINQ_CONSTEXPR explicit operator bool() override {
+        settle();
         return bool(parent_);
     }
 
-    enumerator<T>& operator++() override {
-        while (++parent_ && !predicate_(*parent_))
-            ;
+    /// Once the demanded matches have been read, the parent is advanced once and the search for the next
+    /// match is put off until someone asks for it.
+    LINQ_CONSTEXPR enumerator<T>& operator++() override {
+        settle();
+        ++parent_;
+        is_settled_ = false;
+        if (demand_ != SIZE_MAX && demand_ > 0 && --demand_ == 0)
+            return *this;
+        settle();
         return *this;
     }
 
-    const T& operator*() override {
+    LINQ_CONSTEXPR const T& operator*() override {
+        settle();
         return *parent_;
     }
 
+    /// The number of matches upstream is unknown, so the demand is not forwarded.
+    LINQ_CONSTEXPR void limit_demand(std::size_t count) override {
+        demand_ = count;
+    }
+
+    void refresh() override {
+        parent_.refresh();
+        is_settled_ = false;
+        settle();
+    }
+
 private:
+    LINQ_CONSTEXPR void settle() {
+        if (is_settled_)
+            return;
+        while (parent_ && !predicate_(*parent_))
+            ++parent_;
+        is_settled_ = true;
+    }
+
     enumerator<T> &parent_;
     F predicate_;
+    std::size_t demand_;
+    bool is_settled_;
+};
+
+template<typename T>
+class cache_enumerator : public enumerator<T> {
+public:
+    explicit cache_enumerator(enumerator<T> &parent) : state_(std::make_shared<state>(parent)), position_(0) {
+    }
+
+    explicit operator bool() override {
+        return state_->load(position_);
+    }
+
+    enumerator<T>& operator++() override {
+        if (state_->load(position_))
+            position_++;
+        return *this;
+    }
+
+    const T& operator*() override {
+        state_->load(position_);
+        return state_->buffer[position_];
+    }
+
+    void refresh() override {
+        state_->parent.refresh();
+    }
+
+    /// Starts a new pass from the first element, sharing the buffer.
+    cache_enumerator<T> replay() const {
+        return cache_enumerator<T>(state_);
+    }
+
+private:
+    struct state {
+        explicit state(enumerator<T> &parent) : parent(parent), advance_pending(false) {
+        }
+
+        // Pulls elements from the parent until `position` is buffered; the parent is advanced lazily
+        // so that it never reads past the last requested element.
+        bool load(std::size_t position) {
+            while (buffer.size() <= position) {
+                if (advance_pending) {
+                    ++parent;
+                    advance_pending = false;
+                }
+                if (!parent)
+                    return false;
+                buffer.push_back(*parent);
+                advance_pending = true;
+            }
+            return true;
+        }
+
+        enumerator<T> &parent;
+        std::deque<T> buffer;
+        bool advance_pending;
+    };
+
+    explicit cache_enumerator(std::shared_ptr<state> state) : state_(std::move(state)), position_(0) {
+    }
+
+    std::shared_ptr<state> state_;
+    std::size_t position_;
+};
+
+template<typename T>
+class short_circuit_enumerator : public enumerator<T> {
+public:
+    LINQ_CONSTEXPR explicit short_circuit_enumerator(enumerator<T> &parent) : parent_(parent), is_end_(false) {
+    }
+
+    LINQ_CONSTEXPR explicit operator bool() override {
+        return !is_end_ && bool(parent_);
+    }
+
+    LINQ_CONSTEXPR enumerator<T>& operator++() override {
+        if (!(*parent_).has_value())
+            is_end_ = true;
+        else
+            ++parent_;
+        return *this;
+    }
+
+    LINQ_CONSTEXPR const T& operator*() override {
+        return *parent_;
+    }
+
+    LINQ_CONSTEXPR void limit_demand(std::size_t count) override {
+        parent_.limit_demand(count);
+    }
+
+    void refresh() override {
+        parent_.refresh();
+    }
+
+private:
+    enumerator<T> &parent_;
+    bool is_end_;
+};
+
+/// Owning, type-erased enumerator. The last stage is stored inline when it fits in 64 bytes, otherwise on the
+/// heap. Stages hold their parent by reference, so a query is assembled with then(), which always moves the
+/// query built so far to the heap where its address stays fixed; a query of n stages makes n - 1 allocations
+/// besides any for oversized stages:
+///     any_enumerator<int> q = from(v.begin(), v.end());
+///     q = std::move(q).then([](auto &e) { return e.where(f); });
+/// Each stage reads the previous stage directly, not through its wrapper. to_vector() and copy_to() reach the
+/// last stage through one function pointer per batch and call it statically, but every stage below it is still
+/// called virtually for each element, as in a statically typed chain. bench.cpp checks the two stay level.
+template<typename T>
+class any_enumerator : public enumerator<T> {
+public:
+    static constexpr std::size_t batch_size = 64;
+
+    template<typename E, typename = std::enable_if_t<!std::is_same<std::decay_t<E>, any_enumerator<T>>::value &&
+                                                      std::is_base_of<enumerator<T>, std::decay_t<E>>::value>>
+    any_enumerator(E &&stage) : operations_(&operations_for<std::decay_t<E>>) {
+        using concrete = std::decay_t<E>;
+        concrete *object;
+        if constexpr (stored_inline<concrete>())
+            object = new (storage_) concrete(std::forward<E>(stage));
+        else
+            object = new (::operator new(sizeof(concrete))) concrete(std::forward<E>(stage));
+        object_ = object;
+        stage_ = object;
+    }
+
+    any_enumerator(any_enumerator<T> &&other) noexcept {
+        move_from(other);
+    }
+
+    any_enumerator<T>& operator=(any_enumerator<T> &&other) noexcept {
+        if (this != &other) {
+            reset();
+            move_from(other);
+        }
+        return *this;
+    }
+
+    any_enumerator(const any_enumerator<T> &) = delete;
+    any_enumerator<T>& operator=(const any_enumerator<T> &) = delete;
+
+    ~any_enumerator() {
+        reset();
+    }
+
+    /// Builds the next stage on top of this query and returns an any_enumerator owning both. Allocates once.
+    template<typename Builder>
+    auto then(Builder build) && {
+        assert(stage_);
+        // The new stage reads the upstream stage directly, skipping the wrapper.
+        auto upstream = std::make_shared<any_enumerator<T>>(std::move(*this));
+        enumerator<T> &parent = *upstream->stage_;
+        using stage_type = std::decay_t<decltype(build(parent))>;
+        any_enumerator<typename stage_type::value_type> ans(build(parent));
+        ans.upstream_ = std::move(upstream);
+        return ans;
+    }
+
+    explicit operator bool() override {
+        return stage_ && bool(*stage_);
+    }
+
+    enumerator<T>& operator++() override {
+        ++*stage_;
+        return *this;
+    }
+
+    const T& operator*() override {
+        return **stage_;
+    }
+
+    void limit_demand(std::size_t count) override {
+        if (stage_)
+            stage_->limit_demand(count);
+    }
+
+    void refresh() override {
+        if (stage_)
+            stage_->refresh();
+    }
+
+    bool release_contiguous(const T *&data, std::size_t &size) override {
+        return stage_ && stage_->release_contiguous(data, size);
+    }
+
+    std::vector<T> to_vector() {
+        std::vector<T> ans;
+        if (stage_)
+            operations_->fill(object_, ans, SIZE_MAX);
+        return ans;
+    }
+
+    template<typename Iter>
+    void copy_to(Iter it) {
+        if (!stage_)
+            return;
+        std::vector<T> batch;
+        batch.reserve(batch_size);
+        do {
+            batch.clear();
+            operations_->fill(object_, batch, batch_size);
+            it = std::move(batch.begin(), batch.end(), it);
+        } while (batch.size() == batch_size);
+    }
+
+private:
+    template<typename>
+    friend class any_enumerator;
+
+    static constexpr std::size_t inline_size = 64;
+
+    struct operations {
+        void (*fill)(void *object, std::vector<T> &out, std::size_t count);
+        enumerator<T>* (*move_inline)(void *from, void *to);
+        void (*destroy)(void *object, bool is_inline);
+    };
+
+    template<typename E>
+    static constexpr bool stored_inline() {
+        return sizeof(E) <= inline_size && alignof(E) <= alignof(std::max_align_t) &&
+               std::is_nothrow_move_constructible<E>::value;
+    }
+
+    template<typename E>
+    static void fill(void *object, std::vector<T> &out, std::size_t count) {
+        E &stage = *static_cast<E*>(object);
+        for (; count > 0 && stage.E::operator bool(); count--) {
+            out.push_back(stage.E::operator*());
+            stage.E::operator++();
+        }
+    }
+
+    template<typename E>
+    static enumerator<T>* move_inline(void *from, void *to) {
+        E *source = static_cast<E*>(from);
+        E *target = new (to) E(std::move(*source));
+        source->~E();
+        return target;
+    }
+
+    template<typename E>
+    static void destroy(void *object, bool is_inline) {
+        static_cast<E*>(object)->~E();
+        if (!is_inline)
+            ::operator delete(object);
+    }
+
+    template<typename E>
+    static constexpr operations operations_for = {&fill<E>, &move_inline<E>, &destroy<E>};
+
+    void move_from(any_enumerator<T> &other) {
+        operations_ = other.operations_;
+        object_ = other.object_;
+        stage_ = other.stage_;
+        upstream_ = std::move(other.upstream_);
+        if (object_ == other.storage_) {
+            stage_ = operations_->move_inline(other.object_, storage_);
+            object_ = storage_;
+        }
+        other.operations_ = nullptr;
+        other.object_ = nullptr;
+        other.stage_ = nullptr;
+    }
+
+    // The stage refers to the upstream query, so it is destroyed first.
+    void reset() {
+        if (object_)
+            operations_->destroy(object_, object_ == storage_);
+        operations_ = nullptr;
+        object_ = nullptr;
+        stage_ = nullptr;
+        upstream_.reset();
+    }
+
+    const operations *operations_ = nullptr;
+    void *object_ = nullptr;
+    enumerator<T> *stage_ = nullptr;
+    std::shared_ptr<void> upstream_;
+    alignas(std::max_align_t) unsigned char storage_[inline_size];
+};
+
+template<typename T>
+class concat_enumerator : public enumerator<T> {
+public:
+    explicit concat_enumerator(std::vector<enumerator<T>*> sources) : sources_(std::move(sources)), current_(0) {
+        skip_finished();
+    }
+
+    explicit operator bool() override {
+        return current_ < sources_.size();
+    }
+
+    enumerator<T>& operator++() override {
+        ++*sources_[current_];
+        skip_finished();
+        return *this;
+    }
+
+    const T& operator*() override {
+        return **sources_[current_];
+    }
+
+    void limit_demand(std::size_t count) override {
+        for (enumerator<T> *source : sources_)
+            source->limit_demand(count);
+    }
+
+    /// Sources that were already finished are revisited, so elements appended to them are not lost.
+    void refresh() override {
+        for (enumerator<T> *source : sources_)
+            source->refresh();
+        current_ = 0;
+        skip_finished();
+    }
+
+private:
+    void skip_finished() {
+        while (current_ < sources_.size() && !*sources_[current_])
+            current_++;
+    }
+
+    std::vector<enumerator<T>*> sources_;
+    std::size_t current_;
+};
+
+template<typename First, typename... Rest>
+auto concat(First &&first, Rest &&... rest) {
+    using T = typename std::decay_t<First>::value_type;
+    return concat_enumerator<T>({&first, &rest...});
+}
+
+template<typename T, typename A, typename B, typename F>
+class zip_enumerator : public enumerator<T> {
+public:
+    zip_enumerator(enumerator<A> &first, enumerator<B> &second, F &func)
+            : first_(first), second_(second), func_(std::move(func)), calculated_value_() {
+    }
+
+    explicit operator bool() override {
+        return bool(first_) && bool(second_);
+    }
+
+    enumerator<T>& operator++() override {
+        ++first_;
+        ++second_;
+        calculated_value_.reset();
+        return *this;
+    }
+
+    const T& operator*() override {
+        if (!calculated_value_)
+            calculated_value_.emplace(func_(*first_, *second_));
+        return *calculated_value_;
+    }
+
+    void limit_demand(std::size_t count) override {
+        first_.limit_demand(count);
+        second_.limit_demand(count);
+    }
+
+    void refresh() override {
+        first_.refresh();
+        second_.refresh();
+        calculated_value_.reset();
+    }
+
+private:
+    enumerator<A> &first_;
+    enumerator<B> &second_;
+    F func_;
+    std::optional<T> calculated_value_;
+};
+
+template<typename First, typename Second, typename F>
+auto zip(First &&first, Second &&second, F func) {
+    using A = typename std::decay_t<First>::value_type;
+    using B = typename std::decay_t<Second>::value_type;
+    using T = std::decay_t<std::invoke_result_t<F&, const A&, const B&>>;
+    return zip_enumerator<T, A, B, F>(first, second, func);
+}
+
+/// Streaming k-way merge of sorted sources over a binary heap of source indices.
+/// Equal elements are yielded in the order of their sources.
+template<typename T, typename Comp>
+class merge_enumerator : public enumerator<T> {
+public:
+    merge_enumerator(std::vector<enumerator<T>*> sources, Comp comp) : sources_(std::move(sources)), comp_(std::move(comp)) {
+        build_heap();
+    }
+
+    explicit operator bool() override {
+        return !heap_.empty();
+    }
+
+    enumerator<T>& operator++() override {
+        std::pop_heap(heap_.begin(), heap_.end(), heap_order{this});
+        enumerator<T> &source = *sources_[heap_.back()];
+        ++source;
+        if (source)
+            std::push_heap(heap_.begin(), heap_.end(), heap_order{this});
+        else
+            heap_.pop_back();
+        return *this;
+    }
+
+    const T& operator*() override {
+        return **sources_[heap_.front()];
+    }
+
+    void limit_demand(std::size_t count) override {
+        for (enumerator<T> *source : sources_)
+            source->limit_demand(count);
+    }
+
+    void refresh() override {
+        for (enumerator<T> *source : sources_)
+            source->refresh();
+        build_heap();
+    }
+
+private:
+    void build_heap() {
+        heap_.clear();
+        heap_.reserve(sources_.size());
+        for (std::size_t i = 0; i < sources_.size(); i++) {
+            if (*sources_[i])
+                heap_.push_back(i);
+        }
+        std::make_heap(heap_.begin(), heap_.end(), heap_order{this});
+    }
+
+    struct heap_order {
+        // True if source a goes after source b.
+        bool operator()(std::size_t a, std::size_t b) const {
+            const T &x = **self->sources_[a];
+            const T &y = **self->sources_[b];
+            if (self->comp_(y, x))
+                return true;
+            return !self->comp_(x, y) && b < a;
+        }
+
+        merge_enumerator *self;
+    };
+
+    std::vector<enumerator<T>*> sources_;
+    std::vector<std::size_t> heap_;
+    Comp comp_;
+};
+
+// Not named merge: with five iterator-like arguments ADL would pick std::merge instead.
+template<typename T, typename Comp = std::less<T>>
+auto merge_sorted(std::vector<enumerator<T>*> sources, Comp comp = Comp()) {
+    return merge_enumerator<T, Comp>(std::move(sources), std::move(comp));
+}
+
+template<typename T, typename Args, std::size_t... I>
+auto merge_sorted_by_last(Args args, std::index_sequence<I...>) {
+    return merge_sorted<T>({&std::get<I>(args)...}, std::get<sizeof...(I)>(args));
+}
+
+/// merge_sorted(a, b, ...) or merge_sorted(a, b, ..., comp): a last argument that is not an enumerator is the
+/// comparator.
+template<typename First, typename... Rest, typename = std::enable_if_t<
+        std::is_base_of<enumerator<typename std::decay_t<First>::value_type>, std::decay_t<First>>::value>>
+auto merge_sorted(First &&first, Rest &&... rest) {
+    using T = typename std::decay_t<First>::value_type;
+    using Last = std::decay_t<std::tuple_element_t<sizeof...(Rest), std::tuple<First, Rest...>>>;
+    if constexpr (!std::is_base_of<enumerator<T>, Last>::value)
+        return merge_sorted_by_last<T>(std::forward_as_tuple(first, rest...), std::make_index_sequence<sizeof...(Rest)>());
+    else
+        return merge_sorted<T>({&first, &rest...});
+}
+
+template<typename T>
+class prefetch_enumerator : public enumerator<T> {
+public:
+    prefetch_enumerator(enumerator<T> &parent, std::size_t count)
+            : parent_(parent), slots_(count), head_(0), tail_(0), read_limit_(SIZE_MAX), is_done_(false), is_stopped_(false),
+              is_started_(false), is_advance_pending_(false), sleepers_(0) {
+    }
+
+    prefetch_enumerator(const prefetch_enumerator<T> &) = delete;
+    prefetch_enumerator<T>& operator=(const prefetch_enumerator<T> &) = delete;
+
+    ~prefetch_enumerator() {
+        is_stopped_.store(true);
+        wake();
+        if (reader_.joinable())
+            reader_.join();
+    }
+
+    explicit operator bool() override {
+        if (slots_.empty())
+            return bool(parent_);
+        return wait_for_element();
+    }
+
+    enumerator<T>& operator++() override {
+        if (slots_.empty())
+            ++parent_;
+        else if (wait_for_element()) {
+            head_.store(head_.load(std::memory_order_relaxed) + 1);
+            wake();
+        }
+        return *this;
+    }
+
+    const T& operator*() override {
+        if (slots_.empty())
+            return *parent_;
+        wait_for_element();
+        return *slots_[head_.load(std::memory_order_relaxed) % slots_.size()];
+    }
+
+    void limit_demand(std::size_t count) override {
+        if (!is_started_) {
+            parent_.limit_demand(count);
+            if (slots_.empty())
+                return;
+        }
+        std::size_t head = head_.load(std::memory_order_relaxed);
+        std::size_t limit = count > SIZE_MAX - head ? SIZE_MAX : head + count;
+        if (limit < read_limit_.load(std::memory_order_relaxed))
+            read_limit_.store(limit, std::memory_order_release);
+    }
+
+    /// The parent belongs to the reader thread while it runs, so it is refreshed only once the reader has finished;
+    /// the next access starts a new reader.
+    void refresh() override {
+        if (is_started_) {
+            if (!is_done_.load(std::memory_order_acquire))
+                return;
+            reader_.join();
+            is_started_ = false;
+            is_done_.store(false, std::memory_order_relaxed);
+        }
+        parent_.refresh();
+    }
+
+private:
+    // The reader is started on first access, so stages built on top can still configure the parent.
+    // Demand only bounds read-ahead: asking for an element past it raises the limit and, if the reader
+    // stopped there, starts it again.
+    bool wait_for_element() {
+        std::size_t head = head_.load(std::memory_order_relaxed);
+        if (read_limit_.load(std::memory_order_relaxed) <= head)
+            read_limit_.store(head + 1, std::memory_order_release);
+        while (head == tail_.load(std::memory_order_acquire)) {
+            if (!is_started_) {
+                is_started_ = true;
+                reader_ = std::thread([this] { read(); });
+            } else if (is_done_.load(std::memory_order_acquire)) {
+                if (head != tail_.load(std::memory_order_acquire))
+                    return true;
+                if (!is_advance_pending_)
+                    return false;
+                reader_.join();
+                is_started_ = false;
+                is_done_.store(false, std::memory_order_relaxed);
+            } else {
+                wait_until([&] { return head != tail_.load() || is_done_.load(); });
+            }
+        }
+        return true;
+    }
+
+    // Single producer: the parent is only touched from this thread once it is started. The parent is
+    // advanced only when there is room for the next element, so at most slots_.size() elements are read ahead,
+    // and not past the demand reported from downstream. is_advance_pending_ tells whether the last element
+    // read is still the parent's current one.
+    void read() {
+        std::size_t tail = tail_.load(std::memory_order_relaxed);
+        while (!is_stopped_.load(std::memory_order_acquire)) {
+            if (is_advance_pending_) {
+                if (tail >= read_limit_.load(std::memory_order_acquire))
+                    break;
+                wait_until([&] { return tail - head_.load() < slots_.size() || is_stopped_.load(); });
+                if (is_stopped_.load(std::memory_order_acquire))
+                    break;
+                ++parent_;
+                is_advance_pending_ = false;
+            }
+            if (!bool(parent_))
+                break;
+            slots_[tail % slots_.size()].emplace(*parent_);
+            is_advance_pending_ = true;
+            tail_.store(++tail);
+            wake();
+        }
+        is_done_.store(true);
+        wake();
+    }
+
+    // Both sides spin briefly, since the other one is usually just about to publish, and then sleep on
+    // the condition variable. The state a waiter checks is stored before sleepers_ is read and sleepers_
+    // is raised before the state is checked, all sequentially consistent, so a wakeup cannot be missed.
+    template<typename Ready>
+    void wait_until(Ready ready) {
+        for (int spin = 0; spin < spin_count; spin++) {
+            if (ready())
+                return;
+            std::this_thread::yield();
+        }
+        sleepers_.fetch_add(1);
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            wakeup_.wait(lock, ready);
+        }
+        sleepers_.fetch_sub(1);
+    }
+
+    void wake() {
+        if (sleepers_.load() > 0) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            wakeup_.notify_all();
+        }
+    }
+
+    static constexpr int spin_count = 64;
+
+    enumerator<T> &parent_;
+    std::vector<std::optional<T>> slots_;
+    std::atomic<std::size_t> head_;
+    std::atomic<std::size_t> tail_;
+    std::atomic<std::size_t> read_limit_;
+    std::atomic<bool> is_done_;
+    std::atomic<bool> is_stopped_;
+    bool is_started_;
+    bool is_advance_pending_;
+    std::atomic<int> sleepers_;
+    std::mutex mutex_;
+    std::condition_variable wakeup_;
+    std::thread reader_;
+};
+
+template<typename T>
+class hyperloglog {
+public:
+    explicit hyperloglog(int precision = 12) : precision_(std::min(std::max(precision, 4), 18)),
+                                               registers_(std::size_t(1) << precision_, 0) {
+    }
+
+    void add(const T &value) {
+        std::uint64_t hash = mix_hash(std::hash<T>()(value));
+        std::size_t index = hash >> (64 - precision_);
+        std::uint64_t rest = (hash << precision_) | (std::uint64_t(1) << (precision_ - 1));
+        std::uint8_t rank = 1;
+        while (!(rest & (std::uint64_t(1) << 63))) {
+            rest <<= 1;
+            rank++;
+        }
+        registers_[index] = std::max(registers_[index], rank);
+    }
+
+    /// Both sketches must have the same precision.
+    void merge(const hyperloglog<T> &other) {
+        assert(precision_ == other.precision_);
+        for (std::size_t i = 0; i < registers_.size(); i++)
+            registers_[i] = std::max(registers_[i], other.registers_[i]);
+    }
+
+    double estimate() const {
+        double m = registers_.size();
+        double sum = 0;
+        std::size_t zeros = 0;
+        for (std::uint8_t rank : registers_) {
+            sum += std::ldexp(1.0, -rank);
+            if (rank == 0)
+                zeros++;
+        }
+        double alpha = 0.7213 / (1 + 1.079 / m);
+        double raw = alpha * m * m / sum;
+        if (raw <= 2.5 * m && zeros > 0)
+            return m * std::log(m / zeros);
+        return raw;
+    }
+
+private:
+    int precision_;
+    std::vector<std::uint8_t> registers_;
+};
+
+/// KLL sketch: a stack of compactors where an item on level i stands for 2^i inputs. A full level is
+/// sorted and every other item (random offset) is promoted, so memory stays O(k log(n / k)).
+template<typename T>
+class quantile_sketch {
+public:
+    explicit quantile_sketch(double eps = 0.01, std::uint64_t seed = 0)
+            : k_(std::max<std::size_t>(8, std::size_t(std::ceil(1.7 / eps)))), count_(0), random_(seed), levels_(1) {
+    }
+
+    void add(const T &value) {
+        levels_[0].push_back(value);
+        count_++;
+        if (levels_[0].size() >= capacity(0))
+            compress();
+    }
+
+    void merge(const quantile_sketch<T> &other) {
+        if (levels_.size() < other.levels_.size())
+            levels_.resize(other.levels_.size());
+        for (std::size_t i = 0; i < other.levels_.size(); i++)
+            levels_[i].insert(levels_[i].end(), other.levels_[i].begin(), other.levels_[i].end());
+        count_ += other.count_;
+        compress();
+    }
+
+    std::size_t count() const {
+        return count_;
+    }
+
+    /// Value whose rank is approximately q * count(), 0 <= q <= 1. The sketch must not be empty.
+    T quantile(double q) const {
+        assert(count_ > 0);
+        std::vector<std::pair<T, std::uint64_t>> weighted;
+        for (std::size_t i = 0; i < levels_.size(); i++) {
+            for (const T &value : levels_[i])
+                weighted.emplace_back(value, std::uint64_t(1) << i);
+        }
+        std::sort(weighted.begin(), weighted.end(),
+                  [](const auto &a, const auto &b) { return a.first < b.first; });
+
+        std::uint64_t total = 0;
+        for (const auto &item : weighted)
+            total += item.second;
+        double target = q * total;
+        std::uint64_t rank = 0;
+        for (const auto &item : weighted) {
+            rank += item.second;
+            if (rank >= target)
+                return item.first;
+        }
+        return weighted.back().first;
+    }
+
+private:
+    std::size_t capacity(std::size_t level) const {
+        std::size_t depth = levels_.size() - 1 - level;
+        return std::max<std::size_t>(2, std::size_t(std::ceil(k_ * std::pow(2.0 / 3, depth))));
+    }
+
+    void compress() {
+        for (std::size_t level = 0; level < levels_.size(); level++) {
+            if (levels_[level].size() < capacity(level))
+                continue;
+            if (level + 1 == levels_.size())
+                levels_.emplace_back();
+
+            std::vector<T> &items = levels_[level];
+            std::sort(items.begin(), items.end());
+            std::optional<T> leftover;
+            if (items.size() % 2 == 1) {
+                leftover.emplace(std::move(items.back()));
+                items.pop_back();
+            }
+            for (std::size_t i = random_.next() & 1; i < items.size(); i += 2)
+                levels_[level + 1].push_back(std::move(items[i]));
+            items.clear();
+            if (leftover)
+                items.push_back(std::move(*leftover));
+        }
+    }
+
+    std::size_t k_;
+    std::size_t count_;
+    sketch_random random_;
+    std::vector<std::vector<T>> levels_;
+};
+
+template<typename T>
+class reservoir_sample {
+public:
+    explicit reservoir_sample(std::size_t capacity, std::uint64_t seed = 0) : capacity_(capacity), count_(0), random_(seed) {
+        items_.reserve(capacity_);
+    }
+
+    void add(const T &value) {
+        count_++;
+        if (items_.size() < capacity_) {
+            items_.push_back(value);
+        } else {
+            std::uint64_t index = random_.below(count_);
+            if (index < capacity_)
+                items_[index] = value;
+        }
+    }
+
+    /// Combines samples of two disjoint parts: each slot is drawn from either side in proportion
+    /// to the number of elements that side has seen.
+    void merge(const reservoir_sample<T> &other) {
+        std::vector<T> left = std::move(items_), right = other.items_;
+        std::uint64_t left_count = count_, right_count = other.count_;
+        items_.clear();
+        while (items_.size() < capacity_ && (!left.empty() || !right.empty())) {
+            bool from_left = right.empty() ||
+                             (!left.empty() && random_.below(left_count + right_count) < left_count);
+            std::vector<T> &side = from_left ? left : right;
+            std::uint64_t &side_count = from_left ? left_count : right_count;
+            std::size_t index = random_.below(side.size());
+            items_.push_back(std::move(side[index]));
+            side[index] = std::move(side.back());
+            side.pop_back();
+            side_count = side_count * side.size() / (side.size() + 1);
+        }
+        count_ += other.count_;
+    }
+
+    std::size_t count() const {
+        return count_;
+    }
+
+    const std::vector<T>& items() const {
+        return items_;
+    }
+
+private:
+    std::size_t capacity_;
+    std::uint64_t count_;
+    sketch_random random_;
+    std::vector<T> items_;
+};
+
+/// Immutable membership set for where_in/where_not_in. Integers from a small range are kept in a dense
+/// bitset, everything else in an open-addressing hash table; an optional Bloom filter in front of the table
+/// rejects most absent keys with two bit probes.
+template<typename T>
+class lookup_set {
+public:
+    template<typename Iter, typename = typename std::iterator_traits<Iter>::iterator_category>
+    lookup_set(Iter begin, Iter end, bool use_bloom_filter = false) : min_(), size_(0) {
+        std::vector<T> values(begin, end);
+        if (values.empty())
+            return;
+
+        if constexpr (is_dense) {
+            using unsigned_type = std::make_unsigned_t<T>;
+            auto bounds = std::minmax_element(values.begin(), values.end());
+            std::uint64_t range = unsigned_type(unsigned_type(*bounds.second) - unsigned_type(*bounds.first));
+            if (range < max_dense_range && range <= std::max<std::uint64_t>(1 << 16, 32 * values.size())) {
+                min_ = *bounds.first;
+                bits_.assign(range / 64 + 1, 0);
+                for (const T &value : values) {
+                    if (!test_bit(bits_, offset(value))) {
+                        set_bit(bits_, offset(value));
+                        size_++;
+                    }
+                }
+                return;
+            }
+        }
+
+        // Duplicates are dropped while inserting, so keys need only std::hash and operator==.
+        std::size_t capacity = 2;
+        while (capacity < 2 * values.size())
+            capacity *= 2;
+        slots_.resize(capacity);
+        is_used_.assign(capacity, false);
+        for (auto &&value : values) {
+            std::size_t slot = mix_hash(std::hash<T>()(value)) & (capacity - 1);
+            while (is_used_[slot] && !(*slots_[slot] == value))
+                slot = (slot + 1) & (capacity - 1);
+            if (is_used_[slot])
+                continue;
+            is_used_[slot] = true;
+            slots_[slot].emplace(std::move(value));
+            size_++;
+        }
+
+        if (use_bloom_filter) {
+            std::size_t words = 1;
+            while (words * 64 < 8 * size_)
+                words *= 2;
+            bloom_.assign(words, 0);
+            for (std::size_t slot = 0; slot < capacity; slot++) {
+                if (is_used_[slot]) {
+                    std::uint64_t hash = mix_hash(std::hash<T>()(*slots_[slot]));
+                    set_bit(bloom_, hash & (words * 64 - 1));
+                    set_bit(bloom_, (hash >> 32) & (words * 64 - 1));
+                }
+            }
+        }
+    }
+
+    lookup_set(std::initializer_list<T> values, bool use_bloom_filter = false)
+            : lookup_set(values.begin(), values.end(), use_bloom_filter) {
+    }
+
+    template<typename Container>
+    explicit lookup_set(const Container &values, bool use_bloom_filter = false)
+            : lookup_set(std::begin(values), std::end(values), use_bloom_filter) {
+    }
+
+    bool contains(const T &value) const {
+        if (!bits_.empty()) {
+            std::uint64_t position = offset(value);
+            return position < bits_.size() * 64 && test_bit(bits_, position);
+        }
+        if (slots_.empty())
+            return false;
+
+        std::uint64_t hash = mix_hash(std::hash<T>()(value));
+        if (!bloom_.empty()) {
+            std::size_t mask = bloom_.size() * 64 - 1;
+            if (!test_bit(bloom_, hash & mask) || !test_bit(bloom_, (hash >> 32) & mask))
+                return false;
+        }
+        std::size_t mask = slots_.size() - 1;
+        for (std::size_t slot = hash & mask; is_used_[slot]; slot = (slot + 1) & mask) {
+            if (*slots_[slot] == value)
+                return true;
+        }
+        return false;
+    }
+
+    std::size_t size() const {
+        return size_;
+    }
+
+private:
+    static constexpr bool is_dense = std::is_integral<T>::value && !std::is_same<T, bool>::value;
+    static constexpr std::uint64_t max_dense_range = std::uint64_t(1) << 28;
+
+    static void set_bit(std::vector<std::uint64_t> &bits, std::uint64_t position) {
+        bits[position / 64] |= std::uint64_t(1) << (position % 64);
+    }
+
+    static bool test_bit(const std::vector<std::uint64_t> &bits, std::uint64_t position) {
+        return (bits[position / 64] >> (position % 64)) & 1;
+    }
+
+    std::uint64_t offset(const T &value) const {
+        if constexpr (is_dense) {
+            using unsigned_type = std::make_unsigned_t<T>;
+            return unsigned_type(unsigned_type(value) - unsigned_type(min_));
+        } else {
+            return 0;
+        }
+    }
+
+    /// Only integers can take the bitset path, so other key types need not be default constructible.
+    std::conditional_t<is_dense, T, char> min_;
+    std::size_t size_;
+    std::vector<std::uint64_t> bits_;
+    std::vector<std::optional<T>> slots_;
+    std::vector<bool> is_used_;
+    std::vector<std::uint64_t> bloom_;
+};
+
+/// Integer sequence stored in blocks of block_size values: the first value of a block is kept in its header,
+/// the rest as zigzag varint deltas. Each header also records min and max, so range scans skip whole blocks
+/// without decoding them. Sorted or slowly changing data takes one or two bytes per value.
+template<typename T>
+class compressed_ints {
+    static_assert(std::is_integral<T>::value, "compressed_ints stores integers only");
+
+public:
+    static constexpr std::size_t block_size = 128;
+
+    struct block {
+        T first, min, max;
+        std::size_t offset;
+        std::size_t count;
+    };
+
+    compressed_ints() : size_(0), last_() {
+    }
+
+    void push_back(T value) {
+        if (blocks_.empty() || blocks_.back().count == block_size) {
+            blocks_.push_back(block{value, value, value, bytes_.size(), 1});
+        } else {
+            block &last = blocks_.back();
+            std::uint64_t delta = std::uint64_t(value) - std::uint64_t(last_);
+            std::int64_t signed_delta = std::int64_t(delta);
+            std::uint64_t zigzag = (delta << 1) ^ std::uint64_t(signed_delta >> 63);
+            while (zigzag >= 0x80) {
+                bytes_.push_back(std::uint8_t(zigzag | 0x80));
+                zigzag >>= 7;
+            }
+            bytes_.push_back(std::uint8_t(zigzag));
+            last.min = std::min(last.min, value);
+            last.max = std::max(last.max, value);
+            last.count++;
+        }
+        last_ = value;
+        size_++;
+    }
+
+    std::size_t size() const {
+        return size_;
+    }
+
+    /// Memory used by the encoded data.
+    std::size_t byte_size() const {
+        return bytes_.size() + blocks_.size() * sizeof(block);
+    }
+
+    const std::vector<block>& blocks() const {
+        return blocks_;
+    }
+
+    /// Decodes the delta starting at bytes()[position] and moves position past it.
+    T decode_next(T previous, std::size_t &position) const {
+        std::uint64_t zigzag = 0;
+        for (int shift = 0;; shift += 7) {
+            std::uint8_t byte = bytes_[position++];
+            zigzag |= std::uint64_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                break;
+        }
+        std::uint64_t delta = (zigzag >> 1) ^ (~(zigzag & 1) + 1);
+        return T(std::uint64_t(previous) + delta);
+    }
+
+private:
+    std::vector<block> blocks_;
+    std::vector<std::uint8_t> bytes_;
+    std::size_t size_;
+    T last_;
+};
+
+template<typename T>
+class compressed_enumerator : public enumerator<T> {
+public:
+    compressed_enumerator(const compressed_ints<T> &source, T lo, T hi)
+            : source_(source), lo_(lo), hi_(hi), block_(0), index_(0), position_(0), value_() {
+        start_block();
+        settle();
+    }
+
+    explicit operator bool() override {
+        return block_ < source_.blocks().size();
+    }
+
+    enumerator<T>& operator++() override {
+        next();
+        settle();
+        return *this;
+    }
+
+    const T& operator*() override {
+        return value_;
+    }
+
+    /// Narrows the rest of the scan, from the current element on, to lo <= x <= hi; blocks outside the range
+    /// are skipped without decoding.
+    compressed_enumerator<T> where_between(T lo, T hi) const {
+        compressed_enumerator<T> narrowed(*this);
+        narrowed.lo_ = std::max(lo, lo_);
+        narrowed.hi_ = std::min(hi, hi_);
+        narrowed.settle();
+        return narrowed;
+    }
+
+private:
+    void start_block() {
+        const auto &blocks = source_.blocks();
+        while (block_ < blocks.size() && (blocks[block_].max < lo_ || hi_ < blocks[block_].min))
+            block_++;
+        if (block_ < blocks.size()) {
+            index_ = 0;
+            position_ = blocks[block_].offset;
+            value_ = blocks[block_].first;
+        }
+    }
+
+    void next() {
+        if (++index_ < source_.blocks()[block_].count) {
+            value_ = source_.decode_next(value_, position_);
+        } else {
+            block_++;
+            start_block();
+        }
+    }
+
+    void settle() {
+        while (block_ < source_.blocks().size() && (value_ < lo_ || hi_ < value_))
+            next();
+    }
+
+    const compressed_ints<T> &source_;
+    T lo_, hi_;
+    std::size_t block_;
+    std::size_t index_;
+    std::size_t position_;
+    T value_;
+};
+
+template<typename T>
+auto from_compressed(const compressed_ints<T> &source) {
+    return compressed_enumerator<T>(source, std::numeric_limits<T>::min(), std::numeric_limits<T>::max());
+}
+
+/// Source over a container that may grow: the end is re-read on every check, so after elements are appended
+/// (and refresh() is called on the last stage) the pipeline continues with them.
+template<typename C>
+class live_enumerator : public enumerator<typename C::value_type> {
+public:
+    using T = typename C::value_type;
+
+    explicit live_enumerator(const C &container) : container_(container), index_(0) {
+    }
+
+    explicit operator bool() override {
+        return index_ < container_.size();
+    }
+
+    enumerator<T>& operator++() override {
+        index_++;
+        return *this;
+    }
+
+    const T& operator*() override {
+        return container_[index_];
+    }
+
+private:
+    const C &container_;
+    std::size_t index_;
+};
+
+template<typename C>
+auto live(const C &container) {
+    return live_enumerator<C>(container);
+}
+
+/// Keeps the position of a pipeline over a live() source together with an aggregate. Each refresh()
+/// consumes only the elements appended since the previous one.
+template<typename T, typename Aggregate>
+class live_query {
+public:
+    live_query(enumerator<T> &stage, Aggregate aggregate) : stage_(stage), aggregate_(std::move(aggregate)) {
+    }
+
+    const Aggregate& refresh() {
+        stage_.refresh();
+        while (stage_) {
+            aggregate_.add(*stage_);
+            ++stage_;
+        }
+        return aggregate_;
+    }
+
+    const Aggregate& aggregate() const {
+        return aggregate_;
+    }
+
+private:
+    enumerator<T> &stage_;
+    Aggregate aggregate_;
+};
+
+template<typename T, typename Aggregate>
+auto make_live_query(enumerator<T> &stage, Aggregate aggregate) {
+    return live_query<T, Aggregate>(stage, std::move(aggregate));
+}
+
+template<typename T>
+class live_count {
+public:
+    live_count() : count_(0) {
+    }
+
+    void add(const T &) {
+        count_++;
+    }
+
+    std::size_t value() const {
+        return count_;
+    }
+
+private:
+    std::size_t count_;
+};
+
+template<typename T>
+class live_sum {
+public:
+    live_sum() : sum_() {
+    }
+
+    void add(const T &x) {
+        sum_ += x;
+    }
+
+    const T& value() const {
+        return sum_;
+    }
+
+private:
+    T sum_;
+};
+
+/// The count greatest elements by comp, kept in a heap with the smallest of them on top.
+template<typename T, typename Comp = std::less<T>>
+class live_top_k {
+public:
+    explicit live_top_k(std::size_t count, Comp comp = Comp()) : count_(count), comp_(std::move(comp)) {
+    }
+
+    void add(const T &x) {
+        auto order = [this](const T &a, const T &b) { return comp_(b, a); };
+        if (heap_.size() < count_) {
+            heap_.push_back(x);
+            std::push_heap(heap_.begin(), heap_.end(), order);
+        } else if (count_ > 0 && comp_(heap_.front(), x)) {
+            std::pop_heap(heap_.begin(), heap_.end(), order);
+            heap_.back() = x;
+            std::push_heap(heap_.begin(), heap_.end(), order);
+        }
+    }
+
+    /// Greatest first.
+    std::vector<T> value() const {
+        std::vector<T> ans = heap_;
+        std::sort(ans.begin(), ans.end(), [this](const T &a, const T &b) { return comp_(b, a); });
+        return ans;
+    }
+
+private:
+    std::size_t count_;
+    Comp comp_;
+    std::vector<T> heap_;
+};
+
+template<typename T>
+class live_distinct {
+public:
+    void add(const T &x) {
+        values_.insert(x);
+    }
+
+    const std::unordered_set<T>& value() const {
+        return values_;
+    }
+
+private:
+    std::unordered_set<T> values_;
 };
 
-#endif
\ No newline at end of file
+#endif
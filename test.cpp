@@ -5,6 +5,9 @@
 #include <vector>
 #include <sstream>
 #include <iterator>
+#include <fstream>
+#include <chrono>
+#include <thread>
 
 void example1() {
     int xs[] = { 1, 2, 3, 4, 5 };
@@ -279,4 +282,637 @@ TEST(select, my_class) {
 
 TEST(main__Test, main__Test_main_Test) {
     main_test();
-}
\ No newline at end of file
+}
+TEST(copy_to, contiguous) {
+    std::vector<int> xs = {1, 2, 3, 4, 5};
+    std::vector<int> res(4);
+    std::vector<int> ans = {2, 3, 4, 5};
+
+    from(xs.begin(), xs.end())
+            .drop(1)
+            .copy_to(res.begin());
+    ASSERT_EQ(res, ans);
+
+    int arr[3] = {0, 0, 0};
+    from(xs.begin(), xs.begin() + 3).copy_to(arr);
+    ASSERT_EQ(std::vector<int>(arr, arr + 3), std::vector<int>({1, 2, 3}));
+}
+
+TEST(copy_to, overlapping) {
+    std::vector<int> xs = {1, 2, 3, 4, 5};
+
+    from(xs.begin() + 1, xs.end()).copy_to(xs.begin());
+    ASSERT_EQ(xs, std::vector<int>({2, 3, 4, 5, 5}));
+}
+
+TEST(to_file, text) {
+    std::vector<int> xs = {1, -20, 300};
+    std::string path = testing::TempDir() + "linq_to_file.txt";
+
+    ASSERT_TRUE(from(xs.begin(), xs.end())
+            .select([](int x) { return x * 2; })
+            .to_file(path.c_str()));
+    std::ifstream in(path);
+    std::string content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    ASSERT_EQ(content, "2\n-40\n600\n");
+}
+
+TEST(to_file, raw) {
+    std::vector<double> xs = {1.5, 2.5, -3.25};
+    std::string path = testing::TempDir() + "linq_to_file.bin";
+
+    ASSERT_TRUE(from(xs.begin(), xs.end()).to_file_raw(path.c_str()));
+    std::ifstream in(path, std::ios::binary);
+    std::vector<double> res(3);
+    in.read(reinterpret_cast<char*>(res.data()), 3 * sizeof(double));
+    ASSERT_EQ(res, xs);
+}
+
+TEST(to_file, raw_empty) {
+    std::vector<double> xs;
+    std::string path = testing::TempDir() + "linq_to_file_empty.bin";
+
+    ASSERT_TRUE(from(xs.begin(), xs.end()).to_file_raw(path.c_str()));
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    ASSERT_EQ(in.tellg(), std::streampos(0));
+}
+
+TEST(cache, replay) {
+    std::vector<int> xs = {1, 2, 3, 4, 5};
+    int calls = 0;
+
+    auto source = from(xs.begin(), xs.end());
+    auto squares = source.select([&calls](int x) { calls++; return x * x; });
+    auto cached = squares.cache();
+    std::vector<int> first = cached.take(2).to_vector();
+    ASSERT_EQ(first, std::vector<int>({1, 4}));
+    ASSERT_EQ(calls, 2);
+
+    std::vector<int> all = cached.replay().to_vector();
+    ASSERT_EQ(all, std::vector<int>({1, 4, 9, 16, 25}));
+    std::vector<int> again = cached.replay().where([](int x) { return x > 5; }).to_vector();
+    ASSERT_EQ(again, std::vector<int>({9, 16, 25}));
+    ASSERT_EQ(calls, 5);
+}
+
+TEST(cache, stream_source) {
+    std::stringstream ss("1 2 3 -1 4");
+    std::istream_iterator<int> in(ss), eof;
+
+    auto source = from(in, eof);
+    auto cached = source.cache();
+    std::vector<int> res = cached.until_eq(-1).to_vector();
+    ASSERT_EQ(res, std::vector<int>({1, 2, 3}));
+    ASSERT_EQ(cached.replay().take(4).to_vector(), std::vector<int>({1, 2, 3, -1}));
+
+    int remaining;
+    ASSERT_TRUE(ss >> remaining);
+    ASSERT_EQ(remaining, 4);
+}
+
+#if LINQ_HAS_CONSTEXPR
+constexpr int constant_xs[] = {1, 2, 3, 4, 5};
+
+constexpr std::array<int, 4> constant_table = from(constant_xs, constant_xs + 5)
+        .select([](int x) { return x * x; })
+        .where([](int x) { return x > 3; })
+        .to_array<4>();
+static_assert(constant_table[0] == 4 && constant_table[1] == 9 && constant_table[2] == 16 && constant_table[3] == 25);
+
+constexpr int constant_count() {
+    return static_cast<int>(from(constant_xs, constant_xs + 5).drop(1).until_eq(5).to_vector().size());
+}
+static_assert(constant_count() == 3);
+
+TEST(constexpr_, to_array) {
+    ASSERT_EQ(constant_table, (std::array<int, 4>{4, 9, 16, 25}));
+}
+#endif
+
+TEST(to_array, exact_size) {
+    std::vector<int> xs = {1, 2, 3};
+
+    ASSERT_EQ(from(xs.begin(), xs.end()).to_array<3>(), (std::array<int, 3>{1, 2, 3}));
+    ASSERT_DEATH(from(xs.begin(), xs.end()).to_array<2>(), "");
+    ASSERT_DEATH(from(xs.begin(), xs.end()).to_array<4>(), "");
+}
+
+TEST(select, deduced_type) {
+    std::vector<int> xs = {1, 4, 9};
+
+    auto res = from(xs.begin(), xs.end())
+            .select([](int x) { return sqrt(x) / 2; })
+            .to_vector();
+    static_assert(std::is_same<decltype(res), std::vector<double>>::value, "result type must be deduced");
+    ASSERT_EQ(res, std::vector<double>({0.5, 1, 1.5}));
+}
+
+TEST(select, reference_and_not_default_constructible) {
+    struct Named {
+        explicit Named(std::string name) : name(std::move(name)) {}
+        std::string name;
+    };
+    std::vector<Named> xs = {Named("a"), Named("bb")};
+
+    auto source = from(xs.begin(), xs.end());
+    auto names = source.select([](const Named &n) -> const std::string& { return n.name; });
+    ASSERT_EQ(&*names, &xs[0].name);
+
+    std::vector<Named> res = from(xs.begin(), xs.end())
+            .select([](const Named &n) { return Named(n.name + "!"); })
+            .to_vector();
+    ASSERT_EQ(res[1].name, "bb!");
+}
+
+expected<int, std::string> parse_int(const std::string &s) {
+    int x = 0;
+    auto res = std::from_chars(s.data(), s.data() + s.size(), x);
+    if (res.ec != std::errc() || res.ptr != s.data() + s.size())
+        return make_unexpected("bad number: " + s);
+    return x;
+}
+
+TEST(expected, where_ok) {
+    std::vector<std::string> xs = {"1", "x", "3"};
+
+    std::vector<int> res = from(xs.begin(), xs.end())
+            .select_expected(parse_int)
+            .where_ok()
+            .select([](const expected<int, std::string> &x) { return *x * 2; })
+            .to_vector();
+    ASSERT_EQ(res, std::vector<int>({2, 6}));
+}
+
+TEST(expected, short_circuit_on_error) {
+    std::vector<std::string> xs = {"1", "2", "x", "4", "y"};
+    int parsed = 0;
+
+    auto res = from(xs.begin(), xs.end())
+            .select_expected([&parsed](const std::string &s) { parsed++; return parse_int(s); })
+            .short_circuit_on_error()
+            .to_vector();
+    ASSERT_EQ(res.size(), 3u);
+    ASSERT_EQ(res[2].error(), "bad number: x");
+    ASSERT_EQ(parsed, 3);
+
+    auto ok = from(xs.begin(), xs.begin() + 2).select_expected(parse_int).to_expected_vector();
+    ASSERT_TRUE(ok.has_value());
+    ASSERT_EQ(*ok, std::vector<int>({1, 2}));
+    auto failed = from(xs.begin(), xs.end()).select_expected(parse_int).to_expected_vector();
+    ASSERT_FALSE(failed.has_value());
+    ASSERT_EQ(failed.error(), "bad number: x");
+}
+
+TEST(any_enumerator, dynamic_query) {
+    std::vector<int> xs(200);
+    for (int i = 0; i < 200; i++)
+        xs[i] = i;
+    bool only_even = true;
+    int limit = 70;
+
+    any_enumerator<int> query = from(xs.begin(), xs.end());
+    if (only_even)
+        query = std::move(query).then([](auto &e) { return e.where([](int x) { return x % 2 == 0; }); });
+    query = std::move(query).then([limit](auto &e) { return e.take(limit); });
+
+    std::vector<int> res = query.to_vector();
+    ASSERT_EQ(res.size(), 70u);
+    ASSERT_EQ(res.front(), 0);
+    ASSERT_EQ(res.back(), 138);
+
+    any_enumerator<double> roots = std::move(query).then([](auto &e) { return e.select([](int x) { return sqrt(x); }); });
+    ASSERT_FALSE(bool(roots));
+}
+
+TEST(any_enumerator, copy_to_in_batches) {
+    std::vector<int> xs(1000);
+    for (int i = 0; i < 1000; i++)
+        xs[i] = i;
+
+    any_enumerator<int> query = from(xs.begin(), xs.end());
+    query = std::move(query).then([](auto &e) { return e.select([](int x) { return x + 1; }); });
+    std::vector<int> res;
+    query.copy_to(std::back_inserter(res));
+    ASSERT_EQ(res.size(), 1000u);
+    ASSERT_EQ(res.back(), 1000);
+}
+
+TEST(any_enumerator, heap_fallback) {
+    std::vector<int> xs = {1, 2, 3};
+    char big[256] = {};
+    big[0] = 10;
+
+    auto source = from(xs.begin(), xs.end());
+    any_enumerator<int> query = source.select([big](int x) { return x + big[0]; });
+    any_enumerator<int> moved = std::move(query);
+    ASSERT_FALSE(bool(query));
+    ASSERT_EQ(moved.to_vector(), std::vector<int>({11, 12, 13}));
+}
+
+TEST(concat, concat) {
+    std::vector<int> xs = {1, 2};
+    std::vector<int> ys = {};
+    std::vector<int> zs = {3, 4, 5};
+
+    std::vector<int> res = concat(from(xs.begin(), xs.end()), from(ys.begin(), ys.end()),
+                                  from(zs.begin(), zs.end()).where_neq(4))
+            .to_vector();
+    ASSERT_EQ(res, std::vector<int>({1, 2, 3, 5}));
+}
+
+TEST(zip, zip) {
+    std::vector<int> xs = {1, 2, 3};
+    std::vector<std::string> ys = {"a", "b"};
+
+    std::vector<std::string> res = zip(from(xs.begin(), xs.end()), from(ys.begin(), ys.end()),
+                                       [](int x, const std::string &y) { return y + std::to_string(x); })
+            .to_vector();
+    ASSERT_EQ(res, std::vector<std::string>({"a1", "b2"}));
+}
+
+TEST(merge, merge) {
+    std::vector<int> xs = {1, 4, 7};
+    std::vector<int> ys = {2, 4, 8, 9};
+    std::vector<int> zs = {0, 10};
+
+    std::vector<int> res = merge_sorted(from(xs.begin(), xs.end()), from(ys.begin(), ys.end()), from(zs.begin(), zs.end()))
+            .to_vector();
+    ASSERT_EQ(res, std::vector<int>({0, 1, 2, 4, 4, 7, 8, 9, 10}));
+}
+
+TEST(merge, many_shards) {
+    const int shard_count = 300;
+    std::vector<std::vector<int>> shards(shard_count);
+    for (int i = 0; i < 3000; i++)
+        shards[(i * 7) % shard_count].push_back(i);
+
+    std::vector<range_enumerator<int, std::vector<int>::iterator>> sources;
+    for (auto &shard : shards)
+        sources.push_back(from(shard.begin(), shard.end()));
+    std::vector<enumerator<int>*> pointers;
+    for (auto &source : sources)
+        pointers.push_back(&source);
+
+    std::vector<int> res = merge_sorted(pointers, std::less<int>()).to_vector();
+    ASSERT_EQ(res.size(), 3000u);
+    ASSERT_TRUE(std::is_sorted(res.begin(), res.end()));
+}
+
+TEST(merge, five_sources) {
+    std::vector<int> a = {1, 6}, b = {2, 7}, c = {3, 8}, d = {4, 9}, e = {0, 5};
+
+    std::vector<int> res = merge_sorted(from(a.begin(), a.end()), from(b.begin(), b.end()), from(c.begin(), c.end()),
+                                        from(d.begin(), d.end()), from(e.begin(), e.end()))
+            .to_vector();
+    ASSERT_EQ(res, std::vector<int>({0, 1, 2, 3, 4, 5, 6, 7, 8, 9}));
+}
+
+TEST(merge, trailing_comparator) {
+    std::vector<int> a = {6, 1}, b = {7, 2}, c = {8, 3}, d = {9, 4}, e = {5, 0};
+
+    std::vector<int> res = merge_sorted(from(a.begin(), a.end()), from(b.begin(), b.end()), std::greater<int>())
+            .to_vector();
+    ASSERT_EQ(res, std::vector<int>({7, 6, 2, 1}));
+    res = merge_sorted(from(a.begin(), a.end()), from(b.begin(), b.end()), from(c.begin(), c.end()),
+                       from(d.begin(), d.end()), from(e.begin(), e.end()), [](int x, int y) { return x > y; })
+            .to_vector();
+    ASSERT_EQ(res, std::vector<int>({9, 8, 7, 6, 5, 4, 3, 2, 1, 0}));
+    res = merge_sorted(from(e.begin(), e.end()), std::greater<int>()).to_vector();
+    ASSERT_EQ(res, std::vector<int>({5, 0}));
+}
+
+TEST(prefetch, keeps_order) {
+    std::vector<int> xs(10000);
+    for (int i = 0; i < 10000; i++)
+        xs[i] = i;
+
+    std::vector<int> res = from(xs.begin(), xs.end())
+            .prefetch(16)
+            .where([](int x) { return x % 3 == 0; })
+            .select([](int x) { return x / 3; })
+            .to_vector();
+    ASSERT_EQ(res.size(), 3334u);
+    for (std::size_t i = 0; i < res.size(); i++)
+        ASSERT_EQ(res[i], static_cast<int>(i));
+}
+
+TEST(prefetch, early_stop) {
+    std::stringstream ss("1 2 3 -1 4 5 6 7 8 9");
+    std::istream_iterator<int> in(ss), eof;
+
+    std::vector<int> res = from(in, eof)
+            .prefetch(2)
+            .until_eq(-1)
+            .to_vector();
+    ASSERT_EQ(res, std::vector<int>({1, 2, 3}));
+
+    std::stringstream exact("1 2 3 -1 4");
+    std::istream_iterator<int> exact_in(exact);
+    res = from(exact_in, eof).prefetch(0).take(4).until_eq(-1).to_vector();
+    ASSERT_EQ(res, std::vector<int>({1, 2, 3}));
+    int remaining;
+    ASSERT_TRUE(exact >> remaining);
+    ASSERT_EQ(remaining, 4);
+}
+
+TEST(prefetch, slow_producer_and_consumer) {
+    std::vector<int> xs = {1, 2, 3, 4, 5, 6, 7, 8};
+    auto pause = [] { std::this_thread::sleep_for(std::chrono::milliseconds(2)); };
+
+    std::vector<int> res = from(xs.begin(), xs.end())
+            .select([&pause](int x) { pause(); return x; })
+            .prefetch(2)
+            .to_vector();
+    ASSERT_EQ(res, xs);
+
+    res.clear();
+    auto source = from(xs.begin(), xs.end());
+    auto prefetched = source.prefetch(2);
+    for (; (bool)prefetched; ++prefetched) {
+        pause();
+        res.push_back(*prefetched);
+    }
+    ASSERT_EQ(res, xs);
+}
+
+TEST(demand, where_take_stops_early) {
+    std::vector<int> xs(1000, 0);
+    xs[10] = 1;
+    xs[20] = 1;
+    int checked = 0;
+
+    std::vector<int> res = from(xs.begin(), xs.end())
+            .where([&checked](int x) { checked++; return x == 1; })
+            .take(1)
+            .to_vector();
+    ASSERT_EQ(res, std::vector<int>({1}));
+    ASSERT_EQ(checked, 11);
+}
+
+TEST(demand, prefetch_reads_only_what_is_taken) {
+    std::stringstream ss("1 2 3 4 5 6 7 8");
+    std::istream_iterator<int> in(ss), eof;
+
+    std::vector<int> res = from(in, eof).prefetch(16).take(3).to_vector();
+    ASSERT_EQ(res, std::vector<int>({1, 2, 3}));
+    int remaining;
+    ASSERT_TRUE(ss >> remaining);
+    ASSERT_EQ(remaining, 4);
+}
+
+TEST(demand, any_enumerator_batch) {
+    std::vector<int> xs(1000, 0);
+    int selected = 0;
+
+    auto source = from(xs.begin(), xs.end());
+    auto counted = source.select([&selected](int x) { selected++; return x; });
+    any_enumerator<int> any = counted;
+    ASSERT_EQ(any.take(5).to_vector().size(), 5u);
+    ASSERT_EQ(selected, 5);
+}
+
+TEST(sketch, approx_count_distinct) {
+    std::vector<int> xs(100000);
+    for (int i = 0; i < 100000; i++)
+        xs[i] = i % 20000;
+
+    hyperloglog<int> sketch = from(xs.begin(), xs.begin() + 50000).approx_count_distinct(12);
+    ASSERT_NEAR(sketch.estimate(), 20000, 20000 * 0.05);
+    sketch.merge(from(xs.begin() + 50000, xs.end()).select([](int x) { return x + 10000; }).approx_count_distinct(12));
+    ASSERT_NEAR(sketch.estimate(), 30000, 30000 * 0.05);
+    ASSERT_NEAR(from(xs.begin(), xs.begin() + 10).approx_count_distinct().estimate(), 10, 1);
+}
+
+TEST(sketch, approx_quantiles) {
+    std::vector<int> xs(100000);
+    for (int i = 0; i < 100000; i++)
+        xs[i] = (i * 7919) % 100000;
+
+    quantile_sketch<int> sketch = from(xs.begin(), xs.begin() + 60000).approx_quantiles(0.01);
+    sketch.merge(from(xs.begin() + 60000, xs.end()).approx_quantiles(0.01));
+    ASSERT_EQ(sketch.count(), 100000u);
+    ASSERT_NEAR(sketch.quantile(0.5), 50000, 100000 * 0.02);
+    ASSERT_NEAR(sketch.quantile(0.99), 99000, 100000 * 0.02);
+}
+
+TEST(sketch, sample) {
+    std::vector<int> xs(1000);
+    for (int i = 0; i < 1000; i++)
+        xs[i] = i;
+
+    reservoir_sample<int> sketch = from(xs.begin(), xs.begin() + 500).sample(100, 1);
+    sketch.merge(from(xs.begin() + 500, xs.end()).sample(100, 2));
+    ASSERT_EQ(sketch.count(), 1000u);
+    ASSERT_EQ(sketch.items().size(), 100u);
+    std::vector<int> items = sketch.items();
+    std::sort(items.begin(), items.end());
+    ASSERT_TRUE(std::unique(items.begin(), items.end()) == items.end());
+    ASSERT_EQ(from(xs.begin(), xs.begin() + 5).sample(10).items(), std::vector<int>({0, 1, 2, 3, 4}));
+}
+
+TEST(where_in, dense_integers) {
+    std::vector<int> xs = {-5, 3, 7, 100, 3, 42};
+    std::vector<int> ids = {3, 42, -5};
+
+    std::vector<int> res = from(xs.begin(), xs.end()).where_in(ids).to_vector();
+    ASSERT_EQ(res, std::vector<int>({-5, 3, 3, 42}));
+    res = from(xs.begin(), xs.end()).where_not_in(ids).to_vector();
+    ASSERT_EQ(res, std::vector<int>({7, 100}));
+}
+
+TEST(where_in, shared_hash_set_with_bloom_filter) {
+    std::vector<long long> ids;
+    for (long long i = 0; i < 1000; i++)
+        ids.push_back(i * 1000000007LL);
+    lookup_set<long long> set(ids, true);
+    ASSERT_EQ(set.size(), 1000u);
+
+    std::vector<long long> xs = {0, 1, 1000000007LL, 5, 999 * 1000000007LL};
+    std::vector<long long> res = from(xs.begin(), xs.end()).where_in(set).to_vector();
+    ASSERT_EQ(res, std::vector<long long>({0, 1000000007LL, 999 * 1000000007LL}));
+    res = from(xs.begin(), xs.end()).where_not_in(set).to_vector();
+    ASSERT_EQ(res, std::vector<long long>({1, 5}));
+
+    std::vector<std::string> names = {"a", "b", "c"};
+    std::vector<std::string> banned = {"b"};
+    ASSERT_EQ(from(names.begin(), names.end()).where_not_in(banned).to_vector(), std::vector<std::string>({"a", "c"}));
+}
+
+struct point {
+    point(int x, int y) : x(x), y(y) {
+    }
+
+    int x, y;
+
+    bool operator==(const point &other) const {
+        return x == other.x && y == other.y;
+    }
+};
+
+namespace std {
+template<>
+struct hash<point> {
+    size_t operator()(const point &p) const {
+        return hash<long long>()((static_cast<long long>(p.x) << 32) ^ p.y);
+    }
+};
+}
+
+TEST(where_in, keys_without_ordering) {
+    std::vector<point> ids = {{1, 2}, {3, 4}, {1, 2}, {5, 6}};
+    lookup_set<point> set(ids);
+    ASSERT_EQ(set.size(), 3u);
+
+    std::vector<point> xs = {{1, 2}, {2, 1}, {5, 6}};
+    std::vector<point> res = from(xs.begin(), xs.end()).where_in(set).to_vector();
+    ASSERT_EQ(res.size(), 2u);
+    ASSERT_TRUE(res[0] == point(1, 2) && res[1] == point(5, 6));
+    res = from(xs.begin(), xs.end()).where_not_in({point(2, 1)}).to_vector();
+    ASSERT_TRUE(res.size() == 2u && res[0] == point(1, 2) && res[1] == point(5, 6));
+}
+
+TEST(where_in, braced_lists) {
+    std::vector<int> xs = {1, 2, 3, 4};
+
+    ASSERT_EQ(from(xs.begin(), xs.end()).where_in({1, 3}).to_vector(), std::vector<int>({1, 3}));
+    ASSERT_EQ(from(xs.begin(), xs.end()).where_in({1, 2, 3}).to_vector(), std::vector<int>({1, 2, 3}));
+    ASSERT_EQ(from(xs.begin(), xs.end()).where_not_in({1, 4}).to_vector(), std::vector<int>({2, 3}));
+
+    lookup_set<int> set = {4, 1};
+    ASSERT_EQ(set.size(), 2u);
+    ASSERT_EQ(from(xs.begin(), xs.end()).where_in(set).to_vector(), std::vector<int>({1, 4}));
+}
+
+TEST(where_in, duplicate_integers) {
+    std::vector<int> ids = {7, 7, 3, 7, 3};
+    ASSERT_EQ(lookup_set<int>(ids).size(), 2u);
+    std::vector<long long> far = {0, 1LL << 40, 0, 1LL << 40};
+    ASSERT_EQ(lookup_set<long long>(far).size(), 2u);
+}
+
+TEST(compressed, round_trip) {
+    std::vector<long long> xs = {5, -3, 1LL << 40, std::numeric_limits<long long>::min(),
+                                 std::numeric_limits<long long>::max(), 0};
+    for (int i = 0; i < 1000; i++)
+        xs.push_back(i * 3);
+
+    compressed_ints<long long> buf = from(xs.begin(), xs.end()).to_compressed();
+    ASSERT_EQ(buf.size(), xs.size());
+    ASSERT_EQ(from_compressed(buf).to_vector(), xs);
+}
+
+TEST(compressed, block_skipping) {
+    std::vector<int> xs(100000);
+    for (int i = 0; i < 100000; i++)
+        xs[i] = i * 2;
+
+    compressed_ints<int> buf = from(xs.begin(), xs.end()).to_compressed();
+    ASSERT_LT(buf.byte_size(), xs.size() * sizeof(int) / 3);
+
+    std::vector<int> res = from_compressed(buf).where_between(1001, 1010).to_vector();
+    ASSERT_EQ(res, std::vector<int>({1002, 1004, 1006, 1008, 1010}));
+    std::vector<int> generic = from(xs.begin(), xs.end()).where_between(1001, 1010).to_vector();
+    ASSERT_EQ(res, generic);
+    ASSERT_EQ(from_compressed(buf).where_between(7, 7).to_vector(), std::vector<int>());
+}
+
+TEST(compressed, where_between_continues_from_current_position) {
+    std::vector<int> xs;
+    for (int round = 0; round < 2; round++)
+        for (int i = 0; i < 500; i++)
+            xs.push_back(i);
+
+    compressed_ints<int> buf = from(xs.begin(), xs.end()).to_compressed();
+    auto scan = from_compressed(buf);
+    for (int i = 0; i < 500; i++)
+        ++scan;
+    ASSERT_EQ(scan.where_between(10, 12).to_vector(), std::vector<int>({10, 11, 12}));
+
+    for (int i = 0; i < 11; i++)
+        ++scan;
+    ASSERT_EQ(scan.where_between(10, 12).to_vector(), std::vector<int>({11, 12}));
+}
+
+TEST(live_query, incremental) {
+    std::vector<int> xs = {1, 2, 3, 4};
+    int checked = 0;
+
+    auto source = live(xs);
+    auto evens = source.where([&checked](int x) { checked++; return x % 2 == 0; });
+    auto squares = evens.select([](int x) { return x * x; });
+    auto sum = make_live_query(squares, live_sum<int>());
+    ASSERT_EQ(sum.refresh().value(), 4 + 16);
+
+    xs.push_back(5);
+    xs.push_back(6);
+    checked = 0;
+    ASSERT_EQ(sum.refresh().value(), 4 + 16 + 36);
+    ASSERT_EQ(checked, 2);
+    ASSERT_EQ(sum.refresh().value(), 4 + 16 + 36);
+}
+
+TEST(live_query, aggregates) {
+    std::vector<int> xs = {5, 1, 5};
+
+    auto source = live(xs);
+    auto dropped = source.drop(1);
+    auto top = make_live_query(dropped, live_top_k<int>(2));
+    ASSERT_EQ(top.refresh().value(), std::vector<int>({5, 1}));
+    xs.insert(xs.end(), {7, 3});
+    ASSERT_EQ(top.refresh().value(), std::vector<int>({7, 5}));
+
+    std::vector<int> ys = {2, 2};
+    auto second = live(ys);
+    auto limited = second.take(4);
+    auto distinct = make_live_query(limited, live_distinct<int>());
+    ASSERT_EQ(distinct.refresh().value().size(), 1u);
+    ys.insert(ys.end(), {3, 4, 5});
+    ASSERT_EQ(distinct.refresh().value().size(), 3u);
+
+    auto counted = make_live_query(source, live_count<int>());
+    ASSERT_EQ(counted.refresh().value(), 0u);
+    xs.push_back(1);
+    ASSERT_EQ(counted.refresh().value(), 1u);
+}
+
+TEST(live_query, until_over_initially_empty_source) {
+    std::vector<int> xs;
+
+    auto source = live(xs);
+    auto head = source.until_eq(-1);
+    auto counted = make_live_query(head, live_count<int>());
+    ASSERT_EQ(counted.refresh().value(), 0u);
+    xs.insert(xs.end(), {1, 2, -1, 3});
+    ASSERT_EQ(counted.refresh().value(), 2u);
+    xs.push_back(4);
+    ASSERT_EQ(counted.refresh().value(), 2u);
+}
+
+TEST(demand, is_only_a_hint) {
+    std::vector<int> xs = {1, 2, 3, 4, 5};
+
+    any_enumerator<int> any = from(xs.begin(), xs.end());
+    ASSERT_EQ(any.take(2).to_vector(), std::vector<int>({1, 2}));
+    ASSERT_EQ(any.to_vector(), std::vector<int>({3, 4, 5}));
+
+    auto source = from(xs.begin(), xs.end());
+    auto prefetched = source.prefetch(4);
+    ASSERT_EQ(prefetched.take(2).to_vector(), std::vector<int>({1, 2}));
+    ASSERT_EQ(prefetched.to_vector(), std::vector<int>({3, 4, 5}));
+
+    auto numbers = from(xs.begin(), xs.end());
+    auto odd = numbers.where([](int x) { return x % 2 == 1; });
+    ASSERT_EQ(odd.take(1).to_vector(), std::vector<int>({1}));
+    ASSERT_EQ(odd.to_vector(), std::vector<int>({3, 5}));
+}
+
+TEST(take, chunks_from_stream) {
+    std::stringstream ss("1 2 3 4 5");
+    std::istream_iterator<int> in(ss), eof;
+
+    auto source = from(in, eof);
+    std::vector<std::vector<int>> chunks;
+    while (source)
+        chunks.push_back(source.take(2).to_vector());
+    ASSERT_EQ(chunks, std::vector<std::vector<int>>({{1, 2}, {3, 4}, {5}}));
+}